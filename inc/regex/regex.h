@@ -1,30 +1,132 @@
 #pragma once
 
+#include <pthread.h>
+
 typedef uint32_t CodePoint;
 
+// compile flags
+enum {
+    RE_ICASE = 1 << 0, // case insensitive, same as (?i)
+};
+
+// error codes
+enum {
+    RE_OK,
+    RE_ESYNTAX, // malformed pattern
+    RE_ESIZE,   // program over instruction or memory limit
+    RE_EDEPTH,  // groups or operators nested over the limit
+    RE_ESTEPS,  // match over step or time limit
+};
+
+// zero means no limit
+typedef struct {
+    int maxins;      // instructions in a program
+    int maxdepth;    // nesting of groups and operators
+    size_t maxmem;   // bytes for a program and one matcher's state
+    long maxsteps;   // states visited in a single match
+    long maxtime;    // microseconds spent in a single match
+} RegExLimits;
+
 typedef struct {
     CodePoint cp;    // from
     CodePoint range; // to
 } Char;
 
+// 8 bytes, meaning of .a and .b depends on the opcode
+// code points and instruction indices both fit in 24 bits
 typedef struct {
-    int op;
-    Char c;
-    int a, b;
+    uint32_t op : 8;
+    uint32_t a : 24;
+    int b;
 } Ins;
 
+// bracket contents live out of line so brackets take a single Ins
+typedef struct {
+    uint32_t ascii[4]; // membership of code points below 0x80
+    int neg;
+    int start;         // sorted, disjoint ranges in RegEx.ranges
+    int num;
+} Class;
+
+// matcher internal, see findloops
+typedef struct Loop Loop;
+
+// compiled program, never modified once built so it can be shared
+// between matchers, freed when the last reference is released
 typedef struct {
     char *src;
-    char *pos;
-    CodePoint cur;
     Ins *ins;
     int numins;
+    Class *classes;
+    int numclasses;
+    int classescap;
+    Char *ranges; // class ranges, .range is always set
+    int numranges;
+    int rangescap;
+    int *toks;    // distinct token IDs, ascending
+    int numtoks;
+    Loop *loops;  // OP_BRACKET's .b is 1 + index of its loop, if any
+    int numloops;
+    int refs;
+} Prog;
+
+// a rule's place in the rule set's current program
+typedef struct {
+    int token;
+    int start;
+    int numins;
+    int classstart;
+    int numclasses;
+    int rangestart;
+    int numranges;
+} Rule;
+
+// token definitions that can be added and removed one at a time,
+// every change publishes a new Prog which matchers pick up on their
+// next match, the program starts with a jump to a dispatch
+// alternation over the live rules that follows their code
+typedef struct {
+    int flags;
+    Rule *rules;  // live rules in priority order
+    int numrules;
+    int rulescap;
+    Prog *prog;   // current version
+    int body;     // instructions preceding prog's dispatch
+    int dead;     // instructions of removed rules still in prog
+    RegExLimits limits;
+    int limitsver; // bumped by rulesetlimits
+    int err;      // of the last rulesetadd
+    char errmsg[64];
+    pthread_mutex_t lock;
+} RuleSet;
+
+typedef struct {
+    char *pos;
+    CodePoint cur;
+    int flags;
+    int depth;
+    RegExLimits limits;
+    int err;
+    char errmsg[64];
+    Prog *prog;
+    RuleSet *rules; // rule set the program is taken from, if any
+    int limitsver;  // of the rule set's limits last copied
     int *clist;
     int clistsz;
     int *nlist;
     int nlistsz;
     char *added;
+    int *stack;     // for addstate
+    int *opentoks;
+    long steps;
+    long nextcheck; // when to look at the clock next
+    long deadline;
     int lasttok;
+    char *tokhit; // per token in set mode
+    int numhits;
+    int *hits;
+    int setmode;
+    int earliest;   // stop at the first match
 } RegEx;
 
 typedef struct {
@@ -33,14 +135,49 @@ typedef struct {
     int token;
 } Match;
 
+// IDs of every token that matched, ascending
+// points into RegEx and is valid until the next match
+typedef struct {
+    int *tokens;
+    int numtokens;
+} MatchSet;
+
 typedef struct {
     char *pattern;
     int token;
 } TokDef;
 
-void regexcompile(RegEx *re, char *src);
-void regexcompile2(RegEx *re, TokDef *defs);
+typedef struct {
+    long hits;
+    long misses;
+    int size;    // programs held
+    int maxsize;
+} RegExCacheStats;
+
+int regexcompile(RegEx *re, char *src);
+int regexcompileflags(RegEx *re, char *src, int flags);
+int regexcompilelimits(RegEx *re, char *src, int flags, RegExLimits *lim);
+int regexcompile2(RegEx *re, TokDef *defs);
+int regexcompile2flags(RegEx *re, TokDef *defs, int flags);
+int regexcompile2limits(RegEx *re, TokDef *defs, int flags, RegExLimits *lim);
+void regexdefaultlimits(RegExLimits *lim);
+const char *regexerror(RegEx *re);
 int regexmatch(RegEx *re, Match *m, char *str);
+int regexismatch(RegEx *re, char *str);
+int regexmatchset(RegEx *re, MatchSet *ms, char *str);
 void regexdumpdot(RegEx *re, FILE *f);
 void regexdumpins(RegEx *re, FILE *f);
 void freeregex(RegEx *re);
+
+void rulesetinit(RuleSet *rs, int flags);
+void rulesetlimits(RuleSet *rs, RegExLimits *lim);
+int rulesetadd(RuleSet *rs, TokDef *def);
+const char *ruleseterror(RuleSet *rs);
+int rulesetremove(RuleSet *rs, int token);
+void rulesetmatcher(RuleSet *rs, RegEx *re);
+void freeruleset(RuleSet *rs);
+
+int regexcompilecached(RegEx *re, char *src, int flags, RegExLimits *lim);
+void regexcachesize(int max);
+void regexcachestats(RegExCacheStats *st);
+void regexcacheclear();
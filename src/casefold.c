@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <regex/regex.h>
+#include "casefold.h"
+
+enum {
+    EVEN_ODD = 1 << 30, // even maps to next, odd to previous
+    ODD_EVEN,           // odd maps to next, even to previous
+};
+
+typedef struct {
+    CodePoint lo, hi;
+    int delta;
+} FoldRange;
+
+// Unicode 14.0 simple case folding (CaseFolding.txt statuses C and S)
+// as orbits of equivalent code points, every entry maps [lo, hi]
+// to the next member of the orbit and the largest wraps to the smallest
+static const FoldRange foldranges[] = {
+    {0x0041, 0x005a, 32}, {0x0061, 0x006a, -32}, {0x006b, 0x006b, 8383},
+    {0x006c, 0x0072, -32}, {0x0073, 0x0073, 268}, {0x0074, 0x007a, -32},
+    {0x00b5, 0x00b5, 743}, {0x00c0, 0x00d6, 32}, {0x00d8, 0x00de, 32},
+    {0x00df, 0x00df, 7615}, {0x00e0, 0x00e4, -32}, {0x00e5, 0x00e5, 8262},
+    {0x00e6, 0x00f6, -32}, {0x00f8, 0x00fe, -32}, {0x00ff, 0x00ff, 121},
+    {0x0100, 0x012f, EVEN_ODD}, {0x0132, 0x0137, EVEN_ODD},
+    {0x0139, 0x0148, ODD_EVEN}, {0x014a, 0x0177, EVEN_ODD},
+    {0x0178, 0x0178, -121}, {0x0179, 0x017e, ODD_EVEN},
+    {0x017f, 0x017f, -300}, {0x0180, 0x0180, 195}, {0x0181, 0x0181, 210},
+    {0x0182, 0x0185, EVEN_ODD}, {0x0186, 0x0186, 206},
+    {0x0187, 0x0188, ODD_EVEN}, {0x0189, 0x018a, 205},
+    {0x018b, 0x018c, ODD_EVEN}, {0x018e, 0x018e, 79}, {0x018f, 0x018f, 202},
+    {0x0190, 0x0190, 203}, {0x0191, 0x0192, ODD_EVEN}, {0x0193, 0x0193, 205},
+    {0x0194, 0x0194, 207}, {0x0195, 0x0195, 97}, {0x0196, 0x0196, 211},
+    {0x0197, 0x0197, 209}, {0x0198, 0x0199, EVEN_ODD}, {0x019a, 0x019a, 163},
+    {0x019c, 0x019c, 211}, {0x019d, 0x019d, 213}, {0x019e, 0x019e, 130},
+    {0x019f, 0x019f, 214}, {0x01a0, 0x01a5, EVEN_ODD}, {0x01a6, 0x01a6, 218},
+    {0x01a7, 0x01a8, ODD_EVEN}, {0x01a9, 0x01a9, 218},
+    {0x01ac, 0x01ad, EVEN_ODD}, {0x01ae, 0x01ae, 218},
+    {0x01af, 0x01b0, ODD_EVEN}, {0x01b1, 0x01b2, 217},
+    {0x01b3, 0x01b6, ODD_EVEN}, {0x01b7, 0x01b7, 219},
+    {0x01b8, 0x01b9, EVEN_ODD}, {0x01bc, 0x01bd, EVEN_ODD},
+    {0x01bf, 0x01bf, 56}, {0x01c4, 0x01c5, 1}, {0x01c6, 0x01c6, -2},
+    {0x01c7, 0x01c8, 1}, {0x01c9, 0x01c9, -2}, {0x01ca, 0x01cb, 1},
+    {0x01cc, 0x01cc, -2}, {0x01cd, 0x01dc, ODD_EVEN}, {0x01dd, 0x01dd, -79},
+    {0x01de, 0x01ef, EVEN_ODD}, {0x01f1, 0x01f2, 1}, {0x01f3, 0x01f3, -2},
+    {0x01f4, 0x01f5, EVEN_ODD}, {0x01f6, 0x01f6, -97}, {0x01f7, 0x01f7, -56},
+    {0x01f8, 0x021f, EVEN_ODD}, {0x0220, 0x0220, -130},
+    {0x0222, 0x0233, EVEN_ODD}, {0x023a, 0x023a, 10795},
+    {0x023b, 0x023c, ODD_EVEN}, {0x023d, 0x023d, -163},
+    {0x023e, 0x023e, 10792}, {0x023f, 0x0240, 10815},
+    {0x0241, 0x0242, ODD_EVEN}, {0x0243, 0x0243, -195}, {0x0244, 0x0244, 69},
+    {0x0245, 0x0245, 71}, {0x0246, 0x024f, EVEN_ODD}, {0x0250, 0x0250, 10783},
+    {0x0251, 0x0251, 10780}, {0x0252, 0x0252, 10782}, {0x0253, 0x0253, -210},
+    {0x0254, 0x0254, -206}, {0x0256, 0x0257, -205}, {0x0259, 0x0259, -202},
+    {0x025b, 0x025b, -203}, {0x025c, 0x025c, 42319}, {0x0260, 0x0260, -205},
+    {0x0261, 0x0261, 42315}, {0x0263, 0x0263, -207}, {0x0265, 0x0265, 42280},
+    {0x0266, 0x0266, 42308}, {0x0268, 0x0268, -209}, {0x0269, 0x0269, -211},
+    {0x026a, 0x026a, 42308}, {0x026b, 0x026b, 10743}, {0x026c, 0x026c, 42305},
+    {0x026f, 0x026f, -211}, {0x0271, 0x0271, 10749}, {0x0272, 0x0272, -213},
+    {0x0275, 0x0275, -214}, {0x027d, 0x027d, 10727}, {0x0280, 0x0280, -218},
+    {0x0282, 0x0282, 42307}, {0x0283, 0x0283, -218}, {0x0287, 0x0287, 42282},
+    {0x0288, 0x0288, -218}, {0x0289, 0x0289, -69}, {0x028a, 0x028b, -217},
+    {0x028c, 0x028c, -71}, {0x0292, 0x0292, -219}, {0x029d, 0x029d, 42261},
+    {0x029e, 0x029e, 42258}, {0x0345, 0x0345, 84}, {0x0370, 0x0373, EVEN_ODD},
+    {0x0376, 0x0377, EVEN_ODD}, {0x037b, 0x037d, 130}, {0x037f, 0x037f, 116},
+    {0x0386, 0x0386, 38}, {0x0388, 0x038a, 37}, {0x038c, 0x038c, 64},
+    {0x038e, 0x038f, 63}, {0x0391, 0x03a1, 32}, {0x03a3, 0x03a3, 31},
+    {0x03a4, 0x03ab, 32}, {0x03ac, 0x03ac, -38}, {0x03ad, 0x03af, -37},
+    {0x03b1, 0x03b1, -32}, {0x03b2, 0x03b2, 30}, {0x03b3, 0x03b4, -32},
+    {0x03b5, 0x03b5, 64}, {0x03b6, 0x03b7, -32}, {0x03b8, 0x03b8, 25},
+    {0x03b9, 0x03b9, 7173}, {0x03ba, 0x03ba, 54}, {0x03bb, 0x03bb, -32},
+    {0x03bc, 0x03bc, -775}, {0x03bd, 0x03bf, -32}, {0x03c0, 0x03c0, 22},
+    {0x03c1, 0x03c1, 48}, {0x03c2, 0x03c2, 1}, {0x03c3, 0x03c5, -32},
+    {0x03c6, 0x03c6, 15}, {0x03c7, 0x03c8, -32}, {0x03c9, 0x03c9, 7517},
+    {0x03ca, 0x03cb, -32}, {0x03cc, 0x03cc, -64}, {0x03cd, 0x03ce, -63},
+    {0x03cf, 0x03cf, 8}, {0x03d0, 0x03d0, -62}, {0x03d1, 0x03d1, 35},
+    {0x03d5, 0x03d5, -47}, {0x03d6, 0x03d6, -54}, {0x03d7, 0x03d7, -8},
+    {0x03d8, 0x03ef, EVEN_ODD}, {0x03f0, 0x03f0, -86}, {0x03f1, 0x03f1, -80},
+    {0x03f2, 0x03f2, 7}, {0x03f3, 0x03f3, -116}, {0x03f4, 0x03f4, -92},
+    {0x03f5, 0x03f5, -96}, {0x03f7, 0x03f8, ODD_EVEN}, {0x03f9, 0x03f9, -7},
+    {0x03fa, 0x03fb, EVEN_ODD}, {0x03fd, 0x03ff, -130}, {0x0400, 0x040f, 80},
+    {0x0410, 0x042f, 32}, {0x0430, 0x0431, -32}, {0x0432, 0x0432, 6222},
+    {0x0433, 0x0433, -32}, {0x0434, 0x0434, 6221}, {0x0435, 0x043d, -32},
+    {0x043e, 0x043e, 6212}, {0x043f, 0x0440, -32}, {0x0441, 0x0442, 6210},
+    {0x0443, 0x0449, -32}, {0x044a, 0x044a, 6204}, {0x044b, 0x044f, -32},
+    {0x0450, 0x045f, -80}, {0x0460, 0x0462, EVEN_ODD}, {0x0463, 0x0463, 6180},
+    {0x0464, 0x0481, EVEN_ODD}, {0x048a, 0x04bf, EVEN_ODD},
+    {0x04c0, 0x04c0, 15}, {0x04c1, 0x04ce, ODD_EVEN}, {0x04cf, 0x04cf, -15},
+    {0x04d0, 0x052f, EVEN_ODD}, {0x0531, 0x0556, 48}, {0x0561, 0x0586, -48},
+    {0x10a0, 0x10c5, 7264}, {0x10c7, 0x10c7, 7264}, {0x10cd, 0x10cd, 7264},
+    {0x10d0, 0x10fa, 3008}, {0x10fd, 0x10ff, 3008}, {0x13a0, 0x13ef, 38864},
+    {0x13f0, 0x13f5, 8}, {0x13f8, 0x13fd, -8}, {0x1c80, 0x1c80, -6254},
+    {0x1c81, 0x1c81, -6253}, {0x1c82, 0x1c82, -6244}, {0x1c83, 0x1c83, -6242},
+    {0x1c84, 0x1c84, 1}, {0x1c85, 0x1c85, -6243}, {0x1c86, 0x1c86, -6236},
+    {0x1c87, 0x1c87, -6181}, {0x1c88, 0x1c88, 35266}, {0x1c90, 0x1cba, -3008},
+    {0x1cbd, 0x1cbf, -3008}, {0x1d79, 0x1d79, 35332}, {0x1d7d, 0x1d7d, 3814},
+    {0x1d8e, 0x1d8e, 35384}, {0x1e00, 0x1e60, EVEN_ODD}, {0x1e61, 0x1e61, 58},
+    {0x1e62, 0x1e95, EVEN_ODD}, {0x1e9b, 0x1e9b, -59},
+    {0x1e9e, 0x1e9e, -7615}, {0x1ea0, 0x1eff, EVEN_ODD}, {0x1f00, 0x1f07, 8},
+    {0x1f08, 0x1f0f, -8}, {0x1f10, 0x1f15, 8}, {0x1f18, 0x1f1d, -8},
+    {0x1f20, 0x1f27, 8}, {0x1f28, 0x1f2f, -8}, {0x1f30, 0x1f37, 8},
+    {0x1f38, 0x1f3f, -8}, {0x1f40, 0x1f45, 8}, {0x1f48, 0x1f4d, -8},
+    {0x1f51, 0x1f51, 8}, {0x1f53, 0x1f53, 8}, {0x1f55, 0x1f55, 8},
+    {0x1f57, 0x1f57, 8}, {0x1f59, 0x1f59, -8}, {0x1f5b, 0x1f5b, -8},
+    {0x1f5d, 0x1f5d, -8}, {0x1f5f, 0x1f5f, -8}, {0x1f60, 0x1f67, 8},
+    {0x1f68, 0x1f6f, -8}, {0x1f70, 0x1f71, 74}, {0x1f72, 0x1f75, 86},
+    {0x1f76, 0x1f77, 100}, {0x1f78, 0x1f79, 128}, {0x1f7a, 0x1f7b, 112},
+    {0x1f7c, 0x1f7d, 126}, {0x1f80, 0x1f87, 8}, {0x1f88, 0x1f8f, -8},
+    {0x1f90, 0x1f97, 8}, {0x1f98, 0x1f9f, -8}, {0x1fa0, 0x1fa7, 8},
+    {0x1fa8, 0x1faf, -8}, {0x1fb0, 0x1fb1, 8}, {0x1fb3, 0x1fb3, 9},
+    {0x1fb8, 0x1fb9, -8}, {0x1fba, 0x1fbb, -74}, {0x1fbc, 0x1fbc, -9},
+    {0x1fbe, 0x1fbe, -7289}, {0x1fc3, 0x1fc3, 9}, {0x1fc8, 0x1fcb, -86},
+    {0x1fcc, 0x1fcc, -9}, {0x1fd0, 0x1fd1, 8}, {0x1fd8, 0x1fd9, -8},
+    {0x1fda, 0x1fdb, -100}, {0x1fe0, 0x1fe1, 8}, {0x1fe5, 0x1fe5, 7},
+    {0x1fe8, 0x1fe9, -8}, {0x1fea, 0x1feb, -112}, {0x1fec, 0x1fec, -7},
+    {0x1ff3, 0x1ff3, 9}, {0x1ff8, 0x1ff9, -128}, {0x1ffa, 0x1ffb, -126},
+    {0x1ffc, 0x1ffc, -9}, {0x2126, 0x2126, -7549}, {0x212a, 0x212a, -8415},
+    {0x212b, 0x212b, -8294}, {0x2132, 0x2132, 28}, {0x214e, 0x214e, -28},
+    {0x2160, 0x216f, 16}, {0x2170, 0x217f, -16}, {0x2183, 0x2184, ODD_EVEN},
+    {0x24b6, 0x24cf, 26}, {0x24d0, 0x24e9, -26}, {0x2c00, 0x2c2f, 48},
+    {0x2c30, 0x2c5f, -48}, {0x2c60, 0x2c61, EVEN_ODD},
+    {0x2c62, 0x2c62, -10743}, {0x2c63, 0x2c63, -3814},
+    {0x2c64, 0x2c64, -10727}, {0x2c65, 0x2c65, -10795},
+    {0x2c66, 0x2c66, -10792}, {0x2c67, 0x2c6c, ODD_EVEN},
+    {0x2c6d, 0x2c6d, -10780}, {0x2c6e, 0x2c6e, -10749},
+    {0x2c6f, 0x2c6f, -10783}, {0x2c70, 0x2c70, -10782},
+    {0x2c72, 0x2c73, EVEN_ODD}, {0x2c75, 0x2c76, ODD_EVEN},
+    {0x2c7e, 0x2c7f, -10815}, {0x2c80, 0x2ce3, EVEN_ODD},
+    {0x2ceb, 0x2cee, ODD_EVEN}, {0x2cf2, 0x2cf3, EVEN_ODD},
+    {0x2d00, 0x2d25, -7264}, {0x2d27, 0x2d27, -7264}, {0x2d2d, 0x2d2d, -7264},
+    {0xa640, 0xa64a, EVEN_ODD}, {0xa64b, 0xa64b, -35267},
+    {0xa64c, 0xa66d, EVEN_ODD}, {0xa680, 0xa69b, EVEN_ODD},
+    {0xa722, 0xa72f, EVEN_ODD}, {0xa732, 0xa76f, EVEN_ODD},
+    {0xa779, 0xa77c, ODD_EVEN}, {0xa77d, 0xa77d, -35332},
+    {0xa77e, 0xa787, EVEN_ODD}, {0xa78b, 0xa78c, ODD_EVEN},
+    {0xa78d, 0xa78d, -42280}, {0xa790, 0xa793, EVEN_ODD},
+    {0xa794, 0xa794, 48}, {0xa796, 0xa7a9, EVEN_ODD},
+    {0xa7aa, 0xa7aa, -42308}, {0xa7ab, 0xa7ab, -42319},
+    {0xa7ac, 0xa7ac, -42315}, {0xa7ad, 0xa7ad, -42305},
+    {0xa7ae, 0xa7ae, -42308}, {0xa7b0, 0xa7b0, -42258},
+    {0xa7b1, 0xa7b1, -42282}, {0xa7b2, 0xa7b2, -42261}, {0xa7b3, 0xa7b3, 928},
+    {0xa7b4, 0xa7c3, EVEN_ODD}, {0xa7c4, 0xa7c4, -48},
+    {0xa7c5, 0xa7c5, -42307}, {0xa7c6, 0xa7c6, -35384},
+    {0xa7c7, 0xa7ca, ODD_EVEN}, {0xa7d0, 0xa7d1, EVEN_ODD},
+    {0xa7d6, 0xa7d9, EVEN_ODD}, {0xa7f5, 0xa7f6, ODD_EVEN},
+    {0xab53, 0xab53, -928}, {0xab70, 0xabbf, -38864}, {0xff21, 0xff3a, 32},
+    {0xff41, 0xff5a, -32}, {0x10400, 0x10427, 40}, {0x10428, 0x1044f, -40},
+    {0x104b0, 0x104d3, 40}, {0x104d8, 0x104fb, -40}, {0x10570, 0x1057a, 39},
+    {0x1057c, 0x1058a, 39}, {0x1058c, 0x10592, 39}, {0x10594, 0x10595, 39},
+    {0x10597, 0x105a1, -39}, {0x105a3, 0x105b1, -39}, {0x105b3, 0x105b9, -39},
+    {0x105bb, 0x105bc, -39}, {0x10c80, 0x10cb2, 64}, {0x10cc0, 0x10cf2, -64},
+    {0x118a0, 0x118bf, 32}, {0x118c0, 0x118df, -32}, {0x16e40, 0x16e5f, 32},
+    {0x16e60, 0x16e7f, -32}, {0x1e900, 0x1e921, 34}, {0x1e922, 0x1e943, -34},
+};
+
+#define NUMFOLDRANGES ((int)(sizeof(foldranges) / sizeof(foldranges[0])))
+
+// returns the entry containing cp or the first one after it
+static const FoldRange *lookup(CodePoint cp) {
+    int lo = 0;
+    int hi = NUMFOLDRANGES;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (foldranges[mid].hi < cp) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < NUMFOLDRANGES ? &foldranges[lo] : 0;
+}
+
+CodePoint foldnext(CodePoint cp) {
+    const FoldRange *f = lookup(cp);
+    if (!f || cp < f->lo) return cp;
+    switch (f->delta) {
+    case EVEN_ODD: return cp % 2 == 0 ? cp + 1 : cp - 1;
+    case ODD_EVEN: return cp % 2 == 1 ? cp + 1 : cp - 1;
+    }
+    return cp + f->delta;
+}
+
+CodePoint foldskip(CodePoint cp) {
+    const FoldRange *f = lookup(cp);
+    if (!f) return UINT32_MAX;
+    return cp < f->lo ? f->lo : cp;
+}
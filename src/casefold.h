@@ -0,0 +1,9 @@
+#pragma once
+
+// returns the next code point in cp's simple case folding orbit,
+// cp itself if it has no other case
+CodePoint foldnext(CodePoint cp);
+
+// returns the first code point not less than cp that has other cases,
+// UINT32_MAX if there's none
+CodePoint foldskip(CodePoint cp);
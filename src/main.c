@@ -6,8 +6,10 @@
 
 static void help() {
     printf("Usage:\n%4sregex [flags] pattern string\n", "");
-    printf("%4s%-12sdon't print matching string\n",
+    printf("%4s%-12sonly report whether it matches, via exit code\n",
             "", "-s");
+    printf("%4s%-12sprint IDs of all matching tokens, if any\n",
+            "", "-a");
     printf("%4s%-12soutput .dot to file or stdout\n",
             "", "-g[file]");
     printf("%4s%-12soutput vm instructions to file or stdout\n",
@@ -16,6 +18,7 @@ static void help() {
 
 int main(int argc, char **argv) {
     int silent = 0;
+    int all = 0;
     int printdot = 0;
     FILE *fdot = 0;
     int printins = 0;
@@ -26,6 +29,9 @@ int main(int argc, char **argv) {
         if (strcmp(argv[i], "-s") == 0) {
             silent = 1;
         } 
+        else if (strcmp(argv[i], "-a") == 0) {
+            all = 1;
+        }
         else if (strncmp(argv[i], "-g", 2) == 0) {
             printdot = 1;
             if (strlen(argv[i]) > 2)
@@ -47,10 +53,24 @@ int main(int argc, char **argv) {
         exit(1);
     }
     RegEx re;
-    regexcompile(&re, argv[i + 0]);
+    if (regexcompile(&re, argv[i + 0])) {
+        printf("%s\n", regexerror(&re));
+        exit(2);
+    }
     Match m;
-    int r = regexmatch(&re, &m, argv[i + 1]);
-    if (r && !silent) {
+    MatchSet ms;
+    int r;
+    // without token IDs there is nothing to list, report the match
+    if (all && re.prog->numtoks) {
+        r = regexmatchset(&re, &ms, argv[i + 1]);
+        for (int k = 0; r && !silent && k < ms.numtokens; k++)
+            printf(k ? " %i" : "%i", ms.tokens[k]);
+        if (r && !silent) printf("\n");
+    }
+    else if (silent) {
+        r = regexismatch(&re, argv[i + 1]);
+    }
+    else if ((r = regexmatch(&re, &m, argv[i + 1]))) {
         if (m.token) printf("%.*s %i\n", m.len, m.start, m.token);
         else printf("%.*s\n", m.len, m.start);
     }
@@ -2,9 +2,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
 #include <limits.h>
 #include <ctype.h>
 #include <regex/regex.h>
+#include "casefold.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define U8BUFSZ 5
 
@@ -41,10 +47,33 @@ struct Node {
     int neg;
 };
 
-#define BIT(n) (1 << (n))
+#define BIT(n) (1u << (n))
 #define LSBS(n) (BIT(n) - 1)
 #define MSBS(n) (LSBS(n) << (8 - (n)))
 
+#define MAXINS LSBS(24) // instruction operands are 24 bits
+#define MAXLOOPSET 8 // states of a loop
+#define MAXLOOPWALK 64
+#define MAXLOOPRANGES 8 // ASCII ranges tested per vector
+
+// a bracket looping back to itself, while the matcher's states are
+// exactly .states every character of the class leads back to them
+// so runs of it are skipped without stepping, see findloops
+struct Loop {
+    int states[MAXLOOPSET];
+    int num;
+    int numascii; // ASCII ranges of the class without NUL, -1 if many
+    uint8_t lo[MAXLOOPRANGES], hi[MAXLOOPRANGES];
+};
+
+// vector loads may read past the end of the string, but never
+// past the end of its page
+#if defined(__GNUC__)
+#define NOASAN __attribute__((no_sanitize_address))
+#else
+#define NOASAN
+#endif
+
 static void u8enc(char *dst, CodePoint cp) {
     if (cp <= 0x7f) {
         dst[0] = cp;
@@ -70,6 +99,16 @@ static void u8enc(char *dst, CodePoint cp) {
     }
 }
 
+// checked in order so that a NUL ends the sequence before
+// anything past it is read
+static int u8cont(char *s, int num) {
+    for (int k = 1; k <= num; k++)
+        if ((s[k] & MSBS(2)) != MSBS(1)) return 0;
+    return 1;
+}
+
+// returns 0 without moving on a byte that can't start a character
+// or a sequence that is cut short
 static int u8dec(CodePoint *dst, char **src) {
     char first = **src;
     if ((first & MSBS(1)) == 0) {
@@ -77,17 +116,20 @@ static int u8dec(CodePoint *dst, char **src) {
         *src = *src + 1;
     }
     else if ((first & MSBS(3)) == MSBS(2)) {
+        if (!u8cont(*src, 1)) return 0;
         *dst = (((*src)[0] & LSBS(5)) << 6)
                 | ((*src)[1] & LSBS(6));
         *src = *src + 2;
     }
     else if ((first & MSBS(4)) == MSBS(3)) {
+        if (!u8cont(*src, 2)) return 0;
         *dst = (((*src)[0] & LSBS(4)) << 12)
                 | (((*src)[1] & LSBS(6)) << 6)
                 | ((*src)[2] & LSBS(6));
         *src = *src + 3;
     }
     else if ((first & MSBS(5)) == MSBS(4)) {
+        if (!u8cont(*src, 3)) return 0;
         *dst = (((*src)[0] & LSBS(3)) << 18)
                 | (((*src)[1] & LSBS(6)) << 12)
                 | (((*src)[2] & LSBS(6)) << 6)
@@ -104,6 +146,20 @@ static void initregex(RegEx *re) {
     memset(re, 0, sizeof(RegEx));
 }
 
+// keeps the first error, later ones are usually fallout from it
+static void vseterror(RegEx *re, int err, char *fmt, va_list ap) {
+    if (re->err) return;
+    re->err = err;
+    vsnprintf(re->errmsg, sizeof(re->errmsg), fmt, ap);
+}
+
+static void seterror(RegEx *re, int err, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vseterror(re, err, fmt, ap);
+    va_end(ap);
+}
+
 static void fprintcp(FILE *f, CodePoint cp) {
     switch (cp) {
     case SP_CP_ANY: fprintf(f, "/any/"); return;
@@ -127,6 +183,11 @@ static void fprintc(FILE *f, Char c) {
     }
 }
 
+// class ranges always have .range set
+static void fprintrange(FILE *f, Char r) {
+    fprintc(f, (Char){r.cp, r.range != r.cp ? r.range : 0});
+}
+
 static void _dumptree(Node *tree) {
     switch (tree->type) {
     case OP_ALT:
@@ -182,12 +243,27 @@ static CodePoint peekc(RegEx *re) {
 }
 
 static void advance(RegEx *re) {
-    if (!u8dec(&re->cur, &re->pos)) {
-        printf("*** couldn't decode [%#x]\n", *re->pos);
+    if (!*re->pos) {
+        re->cur = 0;
+    }
+    else if (!u8dec(&re->cur, &re->pos)) {
+        seterror(re, RE_ESYNTAX, "couldn't decode [%#x]",
+                (unsigned char)*re->pos);
         re->cur = *re->pos++;
     }
 }
 
+// records the error and makes the rest of the pattern look empty
+// so the parser unwinds without looking at it
+static void parseerror(RegEx *re, int err, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vseterror(re, err, fmt, ap);
+    va_end(ap);
+    re->pos = "";
+    re->cur = 0;
+}
+
 static CodePoint isspec(CodePoint cp) {
     switch (cp) {
     case '.':
@@ -223,6 +299,107 @@ static Node *dupl(CodePoint c, Node *child) {
 
 static Node *alt(RegEx *re);
 
+static Node *conchar(Node *n, Char c) {
+    Node *tmp = newnode(OP_CHAR);
+    tmp->c = c;
+    if (!n) return tmp;
+    Node *con = newnode(OP_CON);
+    con->l = n;
+    con->r = tmp;
+    return con;
+}
+
+typedef struct {
+    CodePoint *cps;
+    int num;
+    int cap;
+} CodePoints;
+
+static void addcp(CodePoints *cps, CodePoint cp) {
+    if (cps->num == cps->cap) {
+        cps->cap = cps->cap ? cps->cap * 2 : 16;
+        cps->cps = realloc(cps->cps, cps->cap * sizeof(CodePoint));
+    }
+    cps->cps[cps->num++] = cp;
+}
+
+// collects every code point case equivalent to one in c but not in c
+static void addfolds(CodePoints *cps, Char c) {
+    CodePoint hi = c.range ? c.range : c.cp;
+    for (CodePoint cp = foldskip(c.cp); cp <= hi; cp = foldskip(cp + 1)) {
+        for (CodePoint f = foldnext(cp); f != cp; f = foldnext(f)) {
+            if (f < c.cp || f > hi) addcp(cps, f);
+        }
+    }
+}
+
+// bracket chars are chained to the left
+static void collectfolds(CodePoints *cps, Node *n) {
+    for (; n->type == OP_CON; n = n->l) addfolds(cps, n->r->c);
+    addfolds(cps, n->c);
+}
+
+static int cmpcp(const void *a, const void *b) {
+    CodePoint x = *(CodePoint *)a, y = *(CodePoint *)b;
+    return (x > y) - (x < y);
+}
+
+// extends a chain of bracket chars with their simple case folds
+// so that matching needs no per-character transformation
+static Node *foldchars(Node *n) {
+    CodePoints cps = {0};
+    collectfolds(&cps, n);
+    qsort(cps.cps, cps.num, sizeof(CodePoint), cmpcp);
+    for (int k = 0; k < cps.num;) {
+        Char c = {cps.cps[k++]};
+        while (k < cps.num && cps.cps[k] <= (c.range ? c.range : c.cp) + 1) {
+            if (cps.cps[k] > c.cp) c.range = cps.cps[k];
+            k++;
+        }
+        n = conchar(n, c);
+    }
+    free(cps.cps);
+    return n;
+}
+
+// a single literal code point, a bracket of its cases under RE_ICASE
+static Node *literal(RegEx *re, CodePoint cp) {
+    Node *n = newnode(OP_CHAR);
+    n->c = (Char){cp};
+    if (!(re->flags & RE_ICASE) || foldnext(cp) == cp) return n;
+    Node *b = newnode(OP_BRACKET);
+    b->l = foldchars(n);
+    return b;
+}
+
+// parses flags after "(?" up to and including ':' or ')'
+// and returns the terminator
+static CodePoint groupflags(RegEx *re) {
+    int on = 1;
+    for (;;) {
+        CodePoint cp = peekc(re);
+        if (cp == ':' || cp == ')') {
+            advance(re);
+            return cp;
+        }
+        else if (cp == 'i') {
+            if (on) re->flags |= RE_ICASE;
+            else re->flags &= ~RE_ICASE;
+        }
+        else if (cp == '-' && on) {
+            on = 0;
+        }
+        else {
+            char u8buf[U8BUFSZ];
+            u8enc(u8buf, cp);
+            if (cp) parseerror(re, RE_ESYNTAX, "unrecognized group flag [%s]", u8buf);
+            else parseerror(re, RE_ESYNTAX, "unterminated group");
+            return ':';
+        }
+        advance(re);
+    }
+}
+
 static Node *bracket(RegEx *re) {
     int neg = peekc(re) == '^';
     if (neg) advance(re);
@@ -248,7 +425,7 @@ static Node *bracket(RegEx *re) {
     }
     Node *b = newnode(OP_BRACKET);
     b->neg = neg;
-    b->l = n;
+    b->l = re->flags & RE_ICASE ? foldchars(n) : n;
     return b;
 }
 
@@ -266,13 +443,12 @@ static Node *conchars(Char *cs, int num) {
 }
 
 static Node *escape(RegEx *re) {
-    char buf[16];
     Node *n = newnode(OP_CHAR);
     CodePoint cp = peekc(re);
     advance(re);
     switch (cp) {
     case 0: 
-        printf("*** trailing backslash\n");
+        parseerror(re, RE_ESYNTAX, "trailing backslash");
         n->type = OP_NOP;
         break;
     case 'a': n->c = (Char){'\a'}; break;
@@ -285,6 +461,7 @@ static Node *escape(RegEx *re) {
     case 'v': n->c = (Char){'\v'}; break;
     case 'w': // [A-Za-z0-9_]
     case 'W': // [^A-Za-z0-9_]
+        free(n);
         n = newnode(OP_BRACKET);
         n->neg = (cp == 'W');
         n->l = conchars((Char[]){
@@ -296,12 +473,14 @@ static Node *escape(RegEx *re) {
         break;
     case 'd': // [0-9]
     case 'D': // [^0-9]
+        free(n);
         n = newnode(OP_BRACKET);
         n->neg = (cp == 'D');
         n->l = conchars((Char[]){{'0', '9'}}, 1);
         break;
     case 's': // [ \t\r\n\v\f]
     case 'S': // [^ \t\r\n\v\f]
+        free(n);
         n = newnode(OP_BRACKET);
         n->neg = (cp == 'S');
         n->l = conchars((Char[]){
@@ -309,25 +488,29 @@ static Node *escape(RegEx *re) {
             6);
         break;
     case 'm':
+        free(n);
         n = newnode(OP_MATCH_TOKEN);
-        n->c.cp = 0; // store the token in Char codepoint
-        char *ptr = buf;
-        *ptr = 0;
-        while (isdigit(peekc(re))) {
-            *ptr++ = peekc(re);
+        int tok = 0;
+        while (peekc(re) >= '0' && peekc(re) <= '9') {
+            int d = peekc(re) - '0';
+            if (tok > (INT_MAX - d) / 10) {
+                parseerror(re, RE_ESYNTAX, "token ID out of range");
+                break;
+            }
+            tok = tok * 10 + d;
             advance(re);
         }
-        *ptr = 0;
-        n->c.cp = atoi(buf);
+        n->c.cp = tok; // store the token in Char codepoint
         break;
     default:
         if (isspec(cp)) {
-            n->c = (Char){cp};
+            free(n);
+            n = literal(re, cp);
             break;
         }
-        printf("*** unrecognized escape sequence [");
-        fprintcp(stdout, cp);
-        printf("]\n");
+        char u8buf[U8BUFSZ];
+        u8enc(u8buf, cp);
+        parseerror(re, RE_ESYNTAX, "unrecognized escape sequence [%s]", u8buf);
         n->type = OP_NOP;
         break;
     }
@@ -337,17 +520,36 @@ static Node *escape(RegEx *re) {
 static Node *atom(RegEx *re) {
     Node *n;
     switch (peekc(re)) {
-    case '(':
+    case '(': {
         advance(re);
+        if (re->limits.maxdepth && re->depth >= re->limits.maxdepth) {
+            parseerror(re, RE_EDEPTH, "groups nested too deep");
+            n = newnode(OP_NOP);
+            break;
+        }
+        // flags set inside a group don't leak out of it
+        int flags = re->flags;
+        if (peekc(re) == '?') {
+            advance(re);
+            // (?i) applies to the rest of the enclosing group
+            if (groupflags(re) == ')') {
+                n = newnode(OP_NOP);
+                break;
+            }
+        }
+        re->depth++;
         n = alt(re);
+        re->depth--;
+        re->flags = flags;
         if (peekc(re) == ')') advance(re);
-        else printf("*** unterminated group\n");
+        else parseerror(re, RE_ESYNTAX, "unterminated group");
         break;
+    }
     case '[':
         advance(re);
         n = bracket(re);
         if (peekc(re) == ']') advance(re);
-        else printf("*** unterminated brackets\n");
+        else parseerror(re, RE_ESYNTAX, "unterminated brackets");
         break;
     case 0:
     case '|':
@@ -374,95 +576,185 @@ static Node *atom(RegEx *re) {
         advance(re);
         break;
     default:
-        n = newnode(OP_CHAR);
-        n->c = (Char){peekc(re)};
+        n = literal(re, peekc(re));
         advance(re);
         break;
     }
-    while (isdupl(peekc(re))) {
+    // stacked operators nest as deep as groups do
+    for (int depth = re->depth + 1; isdupl(peekc(re)); depth++) {
+        if (re->limits.maxdepth && depth > re->limits.maxdepth) {
+            parseerror(re, RE_EDEPTH, "operators nested too deep");
+            break;
+        }
         n = dupl(peekc(re), n);
         advance(re);
     }
     return n;
 }
 
+// sequences and alternations nest to the right so that gen
+// can walk long ones in a loop instead of recursing
 static Node *con(RegEx *re) {
     Node *n = atom(re);
+    Node **last = &n;
     while (peekc(re) && peekc(re) != '|' && peekc(re) != ')') {
         Node *tmp = newnode(OP_CON);
-        tmp->l = n;
+        tmp->l = *last;
         tmp->r = atom(re);
-        n = tmp;
+        *last = tmp;
+        last = &tmp->r;
     }
     return n;
 }
 
 static Node *alt(RegEx *re) {
     Node *n = con(re);
+    Node **last = &n;
     while (peekc(re) == '|') {
         advance(re);
         Node *tmp = newnode(OP_ALT);
-        tmp->l = n;
+        tmp->l = *last;
         tmp->r = con(re);
-        n = tmp;
+        *last = tmp;
+        last = &tmp->r;
     }
     return n;
 }
 
-static void gen(RegEx *re, Node *n) {
+// number of instructions gen emits for n, walks chains like gen does
+static int inscount(Node *n) {
+    int num = 0;
+    for (; n->type == OP_ALT || n->type == OP_CON; n = n->r)
+        num += (n->type == OP_ALT ? 2 : 0) + inscount(n->l);
+    switch (n->type) {
+    case OP_KLEENE:
+        return num + 2 + inscount(n->l);
+    case OP_QUESTION:
+    case OP_PLUS:
+        return num + 1 + inscount(n->l);
+    case OP_BRACKET:
+    case OP_CHAR:
+    case OP_MATCH_TOKEN:
+        return num + 1;
+    default:
+        return num;
+    }
+}
+
+static void *grow(void *ptr, int *cap, int need, int size) {
+    if (need <= *cap) return ptr;
+    while (*cap < need) *cap = *cap ? *cap * 2 : 16;
+    return realloc(ptr, *cap * size);
+}
+
+static void addrange(Prog *p, Char c) {
+    p->ranges = grow(p->ranges, &p->rangescap,
+            p->numranges + 1, sizeof(Char));
+    if (!c.range) c.range = c.cp;
+    if (c.range >= c.cp) p->ranges[p->numranges++] = c;
+}
+
+// bracket chars are chained to the left
+static void collectranges(Prog *p, Node *n) {
+    for (; n->type == OP_CON; n = n->l) addrange(p, n->r->c);
+    addrange(p, n->c);
+}
+
+static int cmprange(const void *a, const void *b) {
+    CodePoint x = ((Char *)a)->cp, y = ((Char *)b)->cp;
+    return (x > y) - (x < y);
+}
+
+// stores the bracket's chars out of line as sorted, disjoint ranges
+// plus a bitmap answering for ASCII directly, returns class index
+static int addclass(Prog *p, Node *n) {
+    p->classes = grow(p->classes, &p->classescap,
+            p->numclasses + 1, sizeof(Class));
+    Class *c = &p->classes[p->numclasses];
+    *c = (Class){.neg = n->neg, .start = p->numranges};
+    collectranges(p, n->l);
+    Char *r = &p->ranges[c->start];
+    int num = p->numranges - c->start;
+    qsort(r, num, sizeof(Char), cmprange);
+    c->num = 0;
+    for (int k = 0; k < num; k++) {
+        Char *last = &r[c->num - 1];
+        if (c->num && r[k].cp <= last->range + 1) {
+            if (r[k].range > last->range) last->range = r[k].range;
+        }
+        else {
+            r[c->num++] = r[k];
+        }
+    }
+    p->numranges = c->start + c->num;
+    for (CodePoint cp = 0; cp < 0x80; cp++) {
+        int m = 0;
+        for (int k = 0; k < c->num && !m; k++)
+            m = r[k].cp <= cp && cp <= r[k].range;
+        if (m != c->neg) c->ascii[cp / 32] |= 1u << (cp % 32);
+    }
+    return p->numclasses++;
+}
+
+static void gen(Prog *p, Node *n) {
     switch (n->type) {
     case OP_ALT: {
-        Ins *split = &re->ins[re->numins++];
-        int a = re->numins;
-        gen(re, n->l);
-        Ins *jmp = &re->ins[re->numins++];
-        int b = re->numins;
-        gen(re, n->r);
-        *jmp = (Ins){OP_JMP, .a = re->numins};
-        *split = (Ins){OP_SPLIT, .a = a, .b = b};
+        // jumps to the end are linked through .a until it's known
+        int jmps = 0;
+        for (; n->type == OP_ALT; n = n->r) {
+            Ins *split = &p->ins[p->numins++];
+            int a = p->numins;
+            gen(p, n->l);
+            p->ins[p->numins] = (Ins){OP_JMP, .a = jmps};
+            jmps = p->numins++;
+            *split = (Ins){OP_SPLIT, .a = a, .b = p->numins};
+        }
+        gen(p, n);
+        while (jmps) {
+            int next = p->ins[jmps].a;
+            p->ins[jmps].a = p->numins;
+            jmps = next;
+        }
         break;
     }
     case OP_KLEENE: {
-        int splitpos = re->numins;
-        Ins *split = &re->ins[re->numins++];
-        *split = (Ins){OP_SPLIT, .a = re->numins};
-        gen(re, n->l);
-        re->ins[re->numins++] = (Ins){OP_JMP, .a = splitpos};
-        split->b = re->numins;
+        int splitpos = p->numins;
+        Ins *split = &p->ins[p->numins++];
+        *split = (Ins){OP_SPLIT, .a = p->numins};
+        gen(p, n->l);
+        p->ins[p->numins++] = (Ins){OP_JMP, .a = splitpos};
+        split->b = p->numins;
         break;
     }
     case OP_QUESTION: {
-        Ins *split = &re->ins[re->numins++];
-        *split = (Ins){OP_SPLIT, .a = re->numins};
-        gen(re, n->l);
-        split->b = re->numins;
+        Ins *split = &p->ins[p->numins++];
+        *split = (Ins){OP_SPLIT, .a = p->numins};
+        gen(p, n->l);
+        split->b = p->numins;
         break;
     }
     case OP_PLUS: {
-        int start = re->numins;
-        gen(re, n->l);
-        Ins *split = &re->ins[re->numins++];
-        *split = (Ins){OP_SPLIT, .a = start, .b = re->numins};
+        int start = p->numins;
+        gen(p, n->l);
+        Ins *split = &p->ins[p->numins++];
+        *split = (Ins){OP_SPLIT, .a = start, .b = p->numins};
         break;
     }
     case OP_CON:
-        gen(re, n->l);
-        gen(re, n->r);
+        for (; n->type == OP_CON; n = n->r) gen(p, n->l);
+        gen(p, n);
         break;
     case OP_BRACKET:
-        // .a = number of "char" commands to follow
-        // .b = negation
-        Ins *bracket = &re->ins[re->numins++];
-        *bracket = (Ins){OP_BRACKET, .b = n->neg};
-        int start = re->numins;
-        gen(re, n->l);
-        bracket->a = re->numins - start;
+        // .a = index into p->classes
+        p->ins[p->numins++] = (Ins){OP_BRACKET, .a = addclass(p, n)};
         break;
     case OP_CHAR:
-        re->ins[re->numins++] = (Ins){OP_CHAR, n->c};
+        // .a = from, .b = to
+        p->ins[p->numins++] = (Ins){OP_CHAR, .a = n->c.cp, .b = n->c.range};
         break;
     case OP_MATCH_TOKEN:
-        re->ins[re->numins++] = (Ins){OP_MATCH_TOKEN, n->c};
+        // .b = token, .a = index into p->toks, see indextokens
+        p->ins[p->numins++] = (Ins){OP_MATCH_TOKEN, .b = n->c.cp};
         break;
     case OP_NOP: break;
     default:
@@ -471,64 +763,90 @@ static void gen(RegEx *re, Node *n) {
     }
 }
 
+// rotates left children up so that freeing needs no recursion
 static void deltree(Node *tree) {
-    switch (tree->type) {
-    case OP_CHAR:
-    case OP_NOP:
-    case OP_MATCH_TOKEN:
-        break;
-    case OP_KLEENE:
-    case OP_QUESTION:
-    case OP_PLUS:
-    case OP_BRACKET:
-        deltree(tree->l);
-        break;
-    case OP_CON:
-    case OP_ALT:
-        deltree(tree->l);
-        deltree(tree->r);
-        break;
-    default:
-        printf("*** can't delete node [%i]\n", tree->type);
-        break;
+    while (tree) {
+        Node *l = tree->l;
+        if (l) {
+            tree->l = l->r;
+            l->r = tree;
+            tree = l;
+        }
+        else {
+            Node *r = tree->r;
+            free(tree);
+            tree = r;
+        }
     }
-    free(tree);
 }
 
 static void resetmatcher(RegEx *re) {
     re->clistsz = 0;
     re->nlistsz = 0;
-    memset(re->added, 0, re->numins);
+    memset(re->added, 0, re->prog->numins);
 }
 
-// returns true if OP_MATCH state was added
+// follows empty transitions from state adding every instruction that
+// consumes input to nlist, returns true if OP_MATCH is reachable
+// walks depth first in order of preference using an explicit stack
+// so that big programs can't overflow the C stack, a token stays open
+// until everything after it is walked so set mode can credit it,
+// in earliest mode the walk is abandoned at the first OP_MATCH
 static int addstate(RegEx *re, int state, int atstart, int atend) {
-    if (re->added[state]) return 0;
-    re->added[state] = 1;
-    Ins *i = &re->ins[state];
-    if (i->op == OP_SPLIT) {
-        int ma = addstate(re, i->a, atstart, atend);
-        int mb = addstate(re, i->b, atstart, atend);
-        return ma || mb;
-    }
-    else if (i->op == OP_JMP) {
-        return addstate(re, i->a, atstart, atend);
-    }
-    else if (i->op == OP_CHAR && i->c.cp == SP_CP_START) {
-        return atstart ? addstate(re, state + 1, atstart, atend) : 0;
-    }
-    else if (i->op == OP_CHAR && i->c.cp == SP_CP_END) {
-        return atend ? addstate(re, state + 1, atstart, atend) : 0;
-    }
-    else if (i->op == OP_MATCH) {
-        return 1;
-    }
-    else if (i->op == OP_MATCH_TOKEN) {
-        re->lasttok = i->c.cp;
-        return addstate(re, state + 1, atstart, atend);
+    Prog *p = re->prog;
+    int matched = 0;
+    int numopen = 0;
+    int sp = 0;
+    re->stack[sp++] = state;
+    while (sp) {
+        int s = re->stack[--sp];
+        if (s < 0) { // done with the most recent token
+            numopen--;
+            continue;
+        }
+        re->steps++;
+        Ins *i = &p->ins[s];
+        // OP_MATCH and OP_JMP are never marked as added so that every
+        // token gets to see the match even when alternatives share a tail,
+        // every loop goes through an OP_SPLIT so this still terminates
+        if (i->op == OP_MATCH) {
+            if (re->earliest) return 1;
+            matched = 1;
+            for (int k = 0; re->setmode && k < numopen; k++) {
+                if (re->tokhit[re->opentoks[k]]) continue;
+                re->tokhit[re->opentoks[k]] = 1;
+                re->numhits++;
+            }
+            continue;
+        }
+        else if (i->op == OP_JMP) {
+            re->stack[sp++] = i->a;
+            continue;
+        }
+        if (re->added[s]) continue;
+        re->added[s] = 1;
+        if (i->op == OP_SPLIT) {
+            re->stack[sp++] = i->b;
+            re->stack[sp++] = i->a;
+        }
+        else if (i->op == OP_CHAR && i->a == SP_CP_START) {
+            if (atstart) re->stack[sp++] = s + 1;
+        }
+        else if (i->op == OP_CHAR && i->a == SP_CP_END) {
+            if (atend) re->stack[sp++] = s + 1;
+        }
+        else if (i->op == OP_MATCH_TOKEN) {
+            // .a = index into re->prog->toks
+            re->lasttok = i->b;
+            re->opentoks[numopen++] = i->a;
+            re->stack[sp++] = -1;
+            re->stack[sp++] = s + 1;
+        }
+        else {
+            re->nlist[re->nlistsz++] = s;
+        }
     }
-    re->nlist[re->nlistsz++] = state;
-    return 0;
+    return matched;
 }
 
 static void swap(RegEx *re) {
@@ -537,28 +855,299 @@ static void swap(RegEx *re) {
     re->nlist = tmp;
     re->clistsz = re->nlistsz;
     re->nlistsz = 0;
-    memset(re->added, 0, re->numins);
+    memset(re->added, 0, re->prog->numins);
 }
 
-void regexcompile(RegEx *re, char *src) {
-    initregex(re);
-    re->src = malloc(strlen(src) + 1);
-    strcpy(re->src, src);
-    re->pos = re->src;
+static int cmptok(const void *a, const void *b) {
+    int x = *(int *)a, y = *(int *)b;
+    return (x > y) - (x < y);
+}
+
+// collects distinct token IDs in ascending order
+// and points every OP_MATCH_TOKEN at its slot in p->toks
+static void indextokens(Prog *p) {
+    p->toks = malloc((p->numins + 1) * sizeof(int));
+    p->numtoks = 0;
+    for (int k = 0; k < p->numins; k++) {
+        if (p->ins[k].op == OP_MATCH_TOKEN)
+            p->toks[p->numtoks++] = p->ins[k].b;
+    }
+    qsort(p->toks, p->numtoks, sizeof(int), cmptok);
+    int n = 0;
+    for (int k = 0; k < p->numtoks; k++) {
+        if (n == 0 || p->toks[n - 1] != p->toks[k])
+            p->toks[n++] = p->toks[k];
+    }
+    p->numtoks = n;
+    for (int k = 0; k < p->numins; k++) {
+        Ins *i = &p->ins[k];
+        if (i->op != OP_MATCH_TOKEN) continue;
+        int tok = i->b;
+        int *slot = bsearch(&tok, p->toks, p->numtoks, sizeof(int), cmptok);
+        i->a = slot - p->toks;
+    }
+}
+
+// the states addstate puts in nlist for state in the middle of the input
+// in the same order, returns -1 if there are too many to be worth it
+static int closure(Prog *p, int state, int *out, int *seen, int gen) {
+    int stack[MAXLOOPWALK + 2];
+    int sp = 0;
+    int num = 0;
+    int steps = 0;
+    stack[sp++] = state;
+    while (sp) {
+        int s = stack[--sp];
+        if (++steps > MAXLOOPWALK) return -1;
+        Ins *i = &p->ins[s];
+        if (i->op == OP_MATCH) continue;
+        if (i->op == OP_JMP) {
+            stack[sp++] = i->a;
+            continue;
+        }
+        if (seen[s] == gen) continue;
+        seen[s] = gen;
+        if (i->op == OP_SPLIT) {
+            stack[sp++] = i->b;
+            stack[sp++] = i->a;
+        }
+        else if (i->op == OP_MATCH_TOKEN) {
+            stack[sp++] = s + 1;
+        }
+        else if (i->op == OP_CHAR
+                && (i->a == SP_CP_START || i->a == SP_CP_END)) {
+            continue;
+        }
+        else {
+            if (num == MAXLOOPSET) return -1;
+            out[num++] = s;
+        }
+    }
+    return num;
+}
+
+static int covers(Char *r, int num, CodePoint lo, CodePoint hi) {
+    for (int k = 0; k < num; k++)
+        if (r[k].cp <= lo && hi <= r[k].range) return 1;
+    return 0;
+}
+
+static int overlaps(Char *r, int num, CodePoint lo, CodePoint hi) {
+    for (int k = 0; k < num; k++)
+        if (r[k].cp <= hi && lo <= r[k].range) return 1;
+    return 0;
+}
+
+// true if no code point is in both sets of sorted, disjoint ranges,
+// two negated sets are assumed to meet
+static int disjoint(Char *a, int numa, int nega, Char *b, int numb, int negb) {
+    if (nega && negb) return 0;
+    if (nega) return disjoint(b, numb, negb, a, numa, nega);
+    for (int k = 0; k < numa; k++) {
+        if (negb ? !covers(b, numb, a[k].cp, a[k].range)
+                : overlaps(b, numb, a[k].cp, a[k].range))
+            return 0;
+    }
+    return 1;
+}
+
+// runs in the class's ASCII bitmap for the vector scan, NUL is
+// left out so that the scan stops at the end of the string
+static void asciiranges(Class *c, Loop *l) {
+    int n = 0;
+    for (int cp = 1; cp < 0x80; cp++) {
+        if (!(c->ascii[cp / 32] >> (cp % 32) & 1)) continue;
+        if (n && l->hi[n - 1] == cp - 1) {
+            l->hi[n - 1] = cp;
+            continue;
+        }
+        if (n == MAXLOOPRANGES) {
+            l->numascii = -1;
+            return;
+        }
+        l->lo[n] = l->hi[n] = cp;
+        n++;
+    }
+    l->numascii = n;
+}
+
+// finds brackets whose successors lead straight back to them, like
+// \w*, [^"]* or \s+, where nothing else live in the loop takes any
+// character of the class, runs of the class can then be skipped
+static void findloops(Prog *p) {
+    int *seen = calloc(p->numins + 1, sizeof(int));
+    int cap = 0;
+    for (int k = 0; k < p->numins; k++) {
+        Ins *i = &p->ins[k];
+        if (i->op != OP_BRACKET) continue;
+        i->b = 0;
+        if (k + 1 == p->numins) continue;
+        Loop l = {{0}};
+        l.num = closure(p, k + 1, l.states, seen, k + 1);
+        if (l.num <= 0 || l.states[0] != k) continue;
+        Class *c = &p->classes[i->a];
+        Char *r = &p->ranges[c->start];
+        int ok = 1;
+        for (int n = 1; n < l.num && ok; n++) {
+            Ins *o = &p->ins[l.states[n]];
+            if (o->op == OP_BRACKET) {
+                Class *oc = &p->classes[o->a];
+                ok = disjoint(r, c->num, c->neg,
+                        &p->ranges[oc->start], oc->num, oc->neg);
+            }
+            else if (o->a == SP_CP_ANY) {
+                ok = 0;
+            }
+            else {
+                Char oc = {o->a, o->b ? o->b : o->a};
+                ok = disjoint(r, c->num, c->neg, &oc, 1, 0);
+            }
+        }
+        if (!ok) continue;
+        asciiranges(c, &l);
+        p->loops = grow(p->loops, &cap, p->numloops + 1, sizeof(Loop));
+        p->loops[p->numloops++] = l;
+        i->b = p->numloops;
+    }
+    free(seen);
+}
+
+static Prog *newprog() {
+    Prog *p = malloc(sizeof(Prog));
+    memset(p, 0, sizeof(Prog));
+    p->refs = 1;
+    return p;
+}
+
+static Prog *retainprog(Prog *p) {
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void releaseprog(Prog *p) {
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL)) return;
+    if (p->src) free(p->src);
+    if (p->ins) free(p->ins);
+    if (p->classes) free(p->classes);
+    if (p->ranges) free(p->ranges);
+    if (p->toks) free(p->toks);
+    if (p->loops) free(p->loops);
+    free(p);
+}
+
+// points the matcher at p taking over the caller's reference
+static void setprog(RegEx *re, Prog *p) {
+    if (re->prog) releaseprog(re->prog);
+    re->prog = p;
+    re->clist = realloc(re->clist, p->numins * sizeof(int));
+    re->nlist = realloc(re->nlist, p->numins * sizeof(int));
+    re->added = realloc(re->added, p->numins);
+    // at most one entry per split and two per token are pending
+    re->stack = realloc(re->stack, (2 * p->numins + 1) * sizeof(int));
+    re->opentoks = realloc(re->opentoks, (p->numins + 1) * sizeof(int));
+    re->tokhit = realloc(re->tokhit, p->numtoks + 1);
+    re->hits = realloc(re->hits, (p->numtoks + 1) * sizeof(int));
+}
+
+// bytes held by a program and the state of one matcher running it
+static size_t progmem(Prog *p) {
+    size_t perins = sizeof(Ins) + 5 * sizeof(int) + 1;
+    size_t pertok = 2 * sizeof(int) + 1;
+    return sizeof(Prog) + sizeof(RegEx)
+            + (p->src ? strlen(p->src) + 1 : 0)
+            + p->numins * perins
+            + p->numclasses * sizeof(Class)
+            + p->numranges * sizeof(Char)
+            + p->numtoks * pertok
+            + p->numloops * sizeof(Loop);
+}
+
+// checks limits that apply to a finished program
+static int checkprog(RegEx *re, Prog *p, RegExLimits *lim) {
+    int maxins = lim->maxins && lim->maxins < MAXINS ? lim->maxins : MAXINS;
+    if (p->numins > maxins)
+        seterror(re, RE_ESIZE, "program exceeds %i instructions", maxins);
+    else if (lim->maxmem && progmem(p) > lim->maxmem)
+        seterror(re, RE_ESIZE, "program exceeds %zu bytes", lim->maxmem);
+    return re->err;
+}
+
+// uses re as parser state, returns 0 and sets re->err on failure
+// a token, if given, is attached to the parsed tree so that a pattern
+// can't reach past it the way it could if they were joined as text
+static Prog *compile(RegEx *re, char *src, int flags, RegExLimits *lim,
+        int *token) {
+    Prog *p = newprog();
+    re->flags = flags;
+    re->limits = *lim;
+    p->src = malloc(strlen(src) + 1);
+    strcpy(p->src, src);
+    re->pos = p->src;
     advance(re);
     Node *tree = alt(re);
     // dumptree(tree);
-    re->ins = malloc(strlen(src) * 3 * sizeof(Ins));
-    re->numins = 0;
-    gen(re, tree);
+    if (peekc(re) == ')') parseerror(re, RE_ESYNTAX, "unmatched )");
+    if (token) {
+        Node *n = newnode(OP_CON);
+        n->l = tree;
+        n->r = newnode(OP_MATCH_TOKEN);
+        n->r->c.cp = *token;
+        tree = n;
+    }
+    if (!re->err) {
+        p->ins = malloc((inscount(tree) + 1) * sizeof(Ins));
+        p->numins = 0;
+        gen(p, tree);
+        p->ins[p->numins++] = (Ins){OP_MATCH};
+        p->ins = realloc(p->ins, p->numins * sizeof(Ins));
+        indextokens(p);
+        findloops(p);
+        checkprog(re, p, lim);
+    }
     deltree(tree);
-    re->ins[re->numins++] = (Ins){OP_MATCH};
-    re->clist = malloc(re->numins * sizeof(int));
-    re->nlist = malloc(re->numins * sizeof(int));
-    re->added = malloc(re->numins);
+    if (!re->err) return p;
+    releaseprog(p);
+    return 0;
+}
+
+void regexdefaultlimits(RegExLimits *lim) {
+    *lim = (RegExLimits){
+        .maxins = MAXINS,
+        .maxdepth = 256,
+    };
+}
+
+const char *regexerror(RegEx *re) {
+    return re->errmsg;
+}
+
+int regexcompile(RegEx *re, char *src) {
+    return regexcompilelimits(re, src, 0, 0);
 }
 
-void regexcompile2(RegEx *re, TokDef *defs) {
+int regexcompileflags(RegEx *re, char *src, int flags) {
+    return regexcompilelimits(re, src, flags, 0);
+}
+
+// default limits if lim is null
+int regexcompilelimits(RegEx *re, char *src, int flags, RegExLimits *lim) {
+    RegExLimits deflim;
+    if (!lim) regexdefaultlimits(lim = &deflim);
+    initregex(re);
+    Prog *p = compile(re, src, flags, lim, 0);
+    if (p) setprog(re, p);
+    return re->err;
+}
+
+int regexcompile2(RegEx *re, TokDef *defs) {
+    return regexcompile2limits(re, defs, 0, 0);
+}
+
+int regexcompile2flags(RegEx *re, TokDef *defs, int flags) {
+    return regexcompile2limits(re, defs, flags, 0);
+}
+
+int regexcompile2limits(RegEx *re, TokDef *defs, int flags, RegExLimits *lim) {
     int srclen = 0;
     int numtoks = 0;
     for (TokDef *td = defs; td->pattern; td++) {
@@ -571,17 +1160,163 @@ void regexcompile2(RegEx *re, TokDef *defs) {
         if (i > 0) ptr += sprintf(ptr, "|");
         ptr += sprintf(ptr, "(%s)\\m%i", defs[i].pattern, defs[i].token);
     }
-    regexcompile(re, src);
+    regexcompilelimits(re, src, flags, lim);
     free(src);
+    return re->err;
 }
 
-static int cmatch(Char c, CodePoint cp) {
-    if (c.cp == SP_CP_ANY) return 1;
-    if (c.range) return c.cp <= cp && cp <= c.range;
-    return c.cp == cp;
+static int cmatch(Ins *i, CodePoint cp) {
+    if (i->a == SP_CP_ANY) return 1;
+    if (i->b) return i->a <= cp && cp <= i->b;
+    return i->a == cp;
 }
 
-int regexmatch(RegEx *re, Match *m, char *str) {
+static int classmatch(Prog *p, Class *c, CodePoint cp) {
+    if (cp < 0x80) return c->ascii[cp / 32] >> (cp % 32) & 1;
+    Char *r = &p->ranges[c->start];
+    int lo = 0;
+    int hi = c->num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r[mid].range < cp) lo = mid + 1;
+        else hi = mid;
+    }
+    int m = lo < c->num && r[lo].cp <= cp;
+    return m != c->neg;
+}
+
+// picks up the latest version and limits of the rule set the matcher
+// follows, this only happens between matches so a match never sees a mix
+static void syncprog(RegEx *re) {
+    RuleSet *rs = re->rules;
+    if (!rs) return;
+    if (__atomic_load_n(&rs->prog, __ATOMIC_ACQUIRE) == re->prog
+            && __atomic_load_n(&rs->limitsver, __ATOMIC_ACQUIRE)
+                == re->limitsver)
+        return;
+    pthread_mutex_lock(&rs->lock);
+    Prog *p = rs->prog != re->prog ? retainprog(rs->prog) : 0;
+    re->limits = rs->limits;
+    re->limitsver = rs->limitsver;
+    pthread_mutex_unlock(&rs->lock);
+    if (p) setprog(re, p);
+}
+
+static long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// checked once per input character, a single character can't take
+// more steps than there are instructions so it doesn't overshoot by much
+static int overbudget(RegEx *re) {
+    RegExLimits *lim = &re->limits;
+    if (lim->maxsteps && re->steps > lim->maxsteps) {
+        seterror(re, RE_ESTEPS, "match exceeds %li steps", lim->maxsteps);
+        return 1;
+    }
+    if (lim->maxtime && re->steps >= re->nextcheck) {
+        re->nextcheck = re->steps + 4096;
+        if (now() > re->deadline) {
+            seterror(re, RE_ESTEPS, "match exceeds %li us", lim->maxtime);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int inascii(Class *c, char ch) {
+    unsigned char u = ch;
+    return u && u < 0x80 && c->ascii[u / 32] >> (u % 32) & 1;
+}
+
+// skips bytes that are ASCII members of the loop's class, stops at
+// anything else including NUL and the start of multibyte sequences
+// a byte is in the class if it's in any of the loop's ASCII ranges,
+// tested for all bytes at once as (byte - lo) <= (hi - lo) unsigned
+NOASAN static char *skipascii(Class *c, Loop *l, char *s) {
+#if defined(__AVX2__)
+    if (l->numascii > 0) {
+        while ((uintptr_t)s % 32) {
+            if (!inascii(c, *s)) return s;
+            s++;
+        }
+        for (;; s += 32) {
+            __m256i v = _mm256_load_si256((__m256i *)s);
+            __m256i in = _mm256_setzero_si256();
+            for (int k = 0; k < l->numascii; k++) {
+                __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(l->lo[k]));
+                __m256i w = _mm256_set1_epi8(l->hi[k] - l->lo[k]);
+                d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, w), d);
+                in = _mm256_or_si256(in, d);
+            }
+            uint32_t out = ~(uint32_t)_mm256_movemask_epi8(in);
+            if (out) return s + __builtin_ctz(out);
+        }
+    }
+#elif defined(__SSE2__)
+    if (l->numascii > 0) {
+        while ((uintptr_t)s % 16) {
+            if (!inascii(c, *s)) return s;
+            s++;
+        }
+        for (;; s += 16) {
+            __m128i v = _mm_load_si128((__m128i *)s);
+            __m128i in = _mm_setzero_si128();
+            for (int k = 0; k < l->numascii; k++) {
+                __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(l->lo[k]));
+                __m128i w = _mm_set1_epi8(l->hi[k] - l->lo[k]);
+                d = _mm_cmpeq_epi8(_mm_min_epu8(d, w), d);
+                in = _mm_or_si128(in, d);
+            }
+            uint32_t out = ~(uint32_t)_mm_movemask_epi8(in) & 0xffff;
+            if (out) return s + __builtin_ctz(out);
+        }
+    }
+#endif
+    while (inascii(c, *s)) s++;
+    return s;
+}
+
+// when the live states are exactly a loop, skips to the last character
+// in the run of its class, that one is left to a normal step so a match
+// or the end of input is seen as usual, returns str otherwise
+static char *skiploop(RegEx *re, char *str) {
+    Prog *p = re->prog;
+    if (!re->clistsz || re->clistsz > MAXLOOPSET) return str;
+    Ins *i = &p->ins[re->clist[0]];
+    if (i->op != OP_BRACKET || !i->b) return str;
+    Loop *l = &p->loops[i->b - 1];
+    if (l->num != re->clistsz
+            || memcmp(l->states, re->clist, l->num * sizeof(int)))
+        return str;
+    Class *c = &p->classes[i->a];
+    char *last = str;
+    char *s = str;
+    for (;;) {
+        char *t = skipascii(c, l, s);
+        if (t > s) last = t - 1;
+        s = t;
+        if (!(*s & MSBS(1))) break;
+        // decoded like a normal step would, bad sequences end the run
+        CodePoint cp;
+        if (!u8dec(&cp, &t) || !classmatch(p, c, cp)) break;
+        last = s;
+        s = t;
+    }
+    re->steps += last - str;
+    return last;
+}
+
+// on running out of budget returns no match with re->err set
+static int run(RegEx *re, Match *m, char *str) {
+    Prog *p = re->prog;
+    re->err = 0;
+    re->errmsg[0] = 0;
+    re->steps = 0;
+    re->nextcheck = 0;
+    if (re->limits.maxtime) re->deadline = now() + re->limits.maxtime;
     re->lasttok = 0;
     char *start = str;
     int atstart = 1;
@@ -590,41 +1325,37 @@ int regexmatch(RegEx *re, Match *m, char *str) {
     if (addstate(re, 0, atstart, !*str)) {
         matched = 1;
         *m = (Match){str, 0, re->lasttok};
+        if (re->earliest) return 1;
     }
     swap(re);
     CodePoint cp = 0;
     while (u8dec(&cp, &str) && cp) {
         if (!re->clistsz) break;
+        if (re->setmode && re->numhits == p->numtoks) break;
         for (int k = 0; k < re->clistsz; k++) {
             int state = re->clist[k];
-            Ins *i = &re->ins[state];
+            Ins *i = &p->ins[state];
             switch (i->op) {
             case OP_CHAR:
-                if (!cmatch(i->c, cp)) break;
+                if (!cmatch(i, cp)) break;
                 if (addstate(re, state + 1, atstart, !*str)) {
                     int len = str - start;
                     if (!matched || len > m->len) {
                         matched = 1;
                         *m = (Match){start, str - start, re->lasttok};
                     }
+                    if (re->earliest) return 1;
                 }
                 break;
             case OP_BRACKET:
-                // .a = number of "char" commands to follow
-                // .b = negation
-                int cm = 0;
-                for (int n = 0; n < i->a; n++) {
-                    Ins *c = &re->ins[state + 1 + n];
-                    if (cm |= cmatch(c->c, cp)) break;
-                }
-                if ((cm && !i->b) || (!cm && i->b)) {
-                    if (addstate(re, state + 1 + i->a, atstart, !*str)) {
-                        int len = str - start;
-                        if (!matched || len > m->len) {
-                            matched = 1;
-                            *m = (Match){start, str - start, re->lasttok};
-                        }
+                if (!classmatch(p, &p->classes[i->a], cp)) break;
+                if (addstate(re, state + 1, atstart, !*str)) {
+                    int len = str - start;
+                    if (!matched || len > m->len) {
+                        matched = 1;
+                        *m = (Match){start, str - start, re->lasttok};
                     }
+                    if (re->earliest) return 1;
                 }
                 break;
             default:
@@ -632,33 +1363,74 @@ int regexmatch(RegEx *re, Match *m, char *str) {
                 return 0;
             }
         }
+        re->steps += re->clistsz;
         swap(re);
         atstart = 0;
+        if (overbudget(re)) return 0;
+        if (p->numloops) str = skiploop(re, str);
     }
     return matched;
 }
 
+int regexmatch(RegEx *re, Match *m, char *str) {
+    syncprog(re);
+    if (!re->prog) return 0;
+    return run(re, m, str);
+}
+
+// stops at the first match instead of looking for the longest one,
+// nothing past that point is read
+int regexismatch(RegEx *re, char *str) {
+    syncprog(re);
+    if (!re->prog) return 0;
+    Match m;
+    re->earliest = 1;
+    int r = run(re, &m, str);
+    re->earliest = 0;
+    return r;
+}
+
+int regexmatchset(RegEx *re, MatchSet *ms, char *str) {
+    syncprog(re);
+    Prog *p = re->prog;
+    *ms = (MatchSet){re->hits, 0};
+    if (!p || !p->numtoks) return 0;
+    Match m;
+    memset(re->tokhit, 0, p->numtoks);
+    re->numhits = 0;
+    re->setmode = 1;
+    int ok = run(re, &m, str) || !re->err;
+    re->setmode = 0;
+    if (!ok) return 0;
+    for (int k = 0; k < p->numtoks; k++) {
+        if (re->tokhit[k]) ms->tokens[ms->numtokens++] = p->toks[k];
+    }
+    return ms->numtokens;
+}
+
 void regexdumpdot(RegEx *re, FILE *f) {
+    Prog *p = re->prog;
+    if (!p) return;
     fprintf(f, "digraph mygraph {\n");
-    fprintf(f, "label=\"%s\"\n", re->src);
+    fprintf(f, "label=\"%s\"\n", p->src ? p->src : "");
     fprintf(f, "fontcolor=blue\n");
     fprintf(f, "node [shape=circle width=0.25 label=\"\"];\n");
     fprintf(f, "edge [label=\" \"];\n");
     fprintf(f, "0 [label=\"S0\"];\n");
     fprintf(f, "rankdir=LR;\n");
-    for (int k = 0; k < re->numins; k++) {
-        Ins *i = &re->ins[k];
+    for (int k = 0; k < p->numins; k++) {
+        Ins *i = &p->ins[k];
         switch (i->op) {
         case OP_CHAR:
             fprintf(f, "%i -> %i [label=\"", k, k + 1);
-            fprintc(f, i->c);
+            fprintc(f, (Char){i->a, i->b});
             fprintf(f, "\"];\n");
             break;
         case OP_MATCH:
             fprintf(f, "%i [label=\"S%i\" shape=doublecircle];\n", k, k);
             break;
         case OP_MATCH_TOKEN:
-            fprintf(f, "%i [label=\"Token|%i\" shape=record];\n", k, i->c.cp);
+            fprintf(f, "%i [label=\"Token|%i\" shape=record];\n", k, i->b);
             fprintf(f, "%i -> %i;\n", k, k + 1);
             break;
         case OP_JMP:
@@ -668,19 +1440,19 @@ void regexdumpdot(RegEx *re, FILE *f) {
             fprintf(f, "%i -> %i;\n", k, i->a);
             fprintf(f, "%i -> %i;\n", k, i->b);
             break;
-        case OP_BRACKET:
-            fprintf(f, "%i -> %i:0;\n", k, k + 1);
-            fprintf(f, "%i:0 -> %i;\n", k + 1, k + 1 + i->a);
-            fprintf(f, "%i [shape=record label=\"<0>%s", k + 1,
-                    i->b ? "none of" : "one of");
-            for (int n = 0; n < i->a; n++) {
-                Ins *c = &re->ins[k + 1 + n];
+        case OP_BRACKET: {
+            Class *c = &p->classes[i->a];
+            fprintf(f, "%i -> c%i:0;\n", k, k);
+            fprintf(f, "c%i:0 -> %i;\n", k, k + 1);
+            fprintf(f, "c%i [shape=record label=\"<0>%s", k,
+                    c->neg ? "none of" : "one of");
+            for (int n = 0; n < c->num; n++) {
                 fprintf(f, "|");
-                fprintc(f, c->c);
+                fprintrange(f, p->ranges[c->start + n]);
             }
             fprintf(f, "\"]\n");
-            k = k + 1 + i->a - 1; // account for k++
             break;
+        }
         default:
             printf("*** can't graphviz instruction [%i]\n", i->op);
             break;
@@ -690,8 +1462,10 @@ void regexdumpdot(RegEx *re, FILE *f) {
 }
 
 void regexdumpins(RegEx *re, FILE *f) {
-    for (int k = 0; k < re->numins; k++) {
-        Ins *i = &re->ins[k];
+    Prog *p = re->prog;
+    if (!p) return;
+    for (int k = 0; k < p->numins; k++) {
+        Ins *i = &p->ins[k];
         fprintf(f, "%2i: ", k);
         switch (i->op) {
         case OP_SPLIT:
@@ -702,18 +1476,25 @@ void regexdumpins(RegEx *re, FILE *f) {
             break;
         case OP_CHAR:
             fprintf(f, "char ");
-            fprintc(f, i->c);
+            fprintc(f, (Char){i->a, i->b});
             fprintf(f, "\n");
             break;
         case OP_MATCH:
             fprintf(f, "match\n");
             break;
         case OP_MATCH_TOKEN:
-            fprintf(f, "token %i\n", i->c.cp);
+            fprintf(f, "token %i\n", i->b);
             break;
-        case OP_BRACKET:
-            fprintf(f, "bracket %s%i\n", i->b ? "!" : "", i->a);
+        case OP_BRACKET: {
+            Class *c = &p->classes[i->a];
+            fprintf(f, "bracket %s%i [", c->neg ? "!" : "", i->a);
+            for (int n = 0; n < c->num; n++) {
+                if (n) fprintf(f, " ");
+                fprintrange(f, p->ranges[c->start + n]);
+            }
+            fprintf(f, "]%s\n", i->b ? " loop" : "");
             break;
+        }
         default:
             printf("*** can't print instruction [%i]\n", i->op);
             break;
@@ -722,10 +1503,428 @@ void regexdumpins(RegEx *re, FILE *f) {
 }
 
 void freeregex(RegEx *re) {
-    if (re->ins) free(re->ins);
+    if (re->prog) releaseprog(re->prog);
     if (re->clist) free(re->clist);
     if (re->nlist) free(re->nlist);
     if (re->added) free(re->added);
-    if (re->src) free(re->src);
+    if (re->stack) free(re->stack);
+    if (re->opentoks) free(re->opentoks);
+    if (re->tokhit) free(re->tokhit);
+    if (re->hits) free(re->hits);
     initregex(re);
 }
+
+// copies a rule's code, classes and ranges from src to the end of dst
+// and updates r to its new place
+static void copyrule(Prog *dst, Prog *src, Rule *r) {
+    int insdelta = dst->numins - r->start;
+    int classdelta = dst->numclasses - r->classstart;
+    int rangedelta = dst->numranges - r->rangestart;
+    for (int k = 0; k < r->numins; k++) {
+        Ins i = src->ins[r->start + k];
+        switch (i.op) {
+        case OP_SPLIT:
+            i.a += insdelta;
+            i.b += insdelta;
+            break;
+        case OP_JMP:
+            i.a += insdelta;
+            break;
+        case OP_BRACKET:
+            i.a += classdelta;
+            break;
+        }
+        dst->ins[dst->numins++] = i;
+    }
+    for (int k = 0; k < r->numclasses; k++) {
+        Class c = src->classes[r->classstart + k];
+        c.start += rangedelta;
+        dst->classes[dst->numclasses++] = c;
+    }
+    for (int k = 0; k < r->numranges; k++)
+        dst->ranges[dst->numranges++] = src->ranges[r->rangestart + k];
+    r->start += insdelta;
+    r->classstart += classdelta;
+    r->rangestart += rangedelta;
+}
+
+// works out the size of the next version, returns true if it's to be
+// compacted, a new rule is expected to be in rs->rules already
+static int plan(RuleSet *rs, Prog *add, Prog *next) {
+    Prog *old = rs->prog;
+    int numrules = rs->numrules - (add ? 1 : 0);
+    int compact = !old || rs->dead * 2 > rs->body;
+    // dead code alone mustn't push the program over the limit
+    int maxins = rs->limits.maxins && rs->limits.maxins < MAXINS
+            ? rs->limits.maxins : MAXINS;
+    if (add && rs->body + add->numins + rs->numrules > maxins) compact = 1;
+    int numins = 1;
+    int numclasses = 1; // class 0 is empty, used when there are no rules
+    int numranges = 0;
+    if (compact) {
+        for (int k = 0; k < numrules; k++) {
+            numins += rs->rules[k].numins;
+            numclasses += rs->rules[k].numclasses;
+            numranges += rs->rules[k].numranges;
+        }
+    }
+    else {
+        numins = rs->body;
+        numclasses = old->numclasses;
+        numranges = old->numranges;
+    }
+    if (add) {
+        numins += add->numins;
+        numclasses += add->numclasses;
+        numranges += add->numranges;
+    }
+    numins += rs->numrules ? rs->numrules : 1;
+    *next = (Prog){
+        .numins = numins,
+        .numclasses = numclasses,
+        .numranges = numranges,
+        .numtoks = (old ? old->numtoks : 0) + (add ? add->numtoks : 0),
+    };
+    return compact;
+}
+
+// builds the next version of the rule set's program
+// the current code is copied as is with dropped rules defused, unless
+// it's mostly dead code in which case live rules are compacted
+// add is the code of a new last rule, a fresh dispatch goes at the end
+static Prog *relink(RuleSet *rs, Prog *add, Rule *drop, int numdrop) {
+    Prog *old = rs->prog;
+    int numrules = rs->numrules - (add ? 1 : 0);
+    Prog size;
+    int compact = plan(rs, add, &size);
+    int numins = size.numins;
+    int numclasses = size.numclasses;
+    int numranges = size.numranges;
+
+    Prog *p = newprog();
+    p->ins = malloc(numins * sizeof(Ins));
+    p->classes = malloc(numclasses * sizeof(Class));
+    p->classescap = numclasses;
+    p->ranges = malloc((numranges + 1) * sizeof(Char));
+    p->rangescap = numranges + 1;
+    if (compact) {
+        p->numins = 1;
+        p->classes[p->numclasses++] = (Class){0};
+        for (int k = 0; k < numrules; k++)
+            copyrule(p, old, &rs->rules[k]);
+        rs->dead = 0;
+    }
+    else {
+        memcpy(p->ins, old->ins, rs->body * sizeof(Ins));
+        memcpy(p->classes, old->classes, old->numclasses * sizeof(Class));
+        if (old->numranges)
+            memcpy(p->ranges, old->ranges, old->numranges * sizeof(Char));
+        p->numins = rs->body;
+        p->numclasses = old->numclasses;
+        p->numranges = old->numranges;
+        // unreachable from now on, but keep their tokens out of p->toks
+        for (int k = 0; k < numdrop; k++) {
+            Rule *r = &drop[k];
+            for (int n = r->start; n < r->start + r->numins; n++) {
+                if (p->ins[n].op == OP_MATCH_TOKEN)
+                    p->ins[n] = (Ins){OP_JMP, .a = n + 1};
+            }
+        }
+    }
+    if (add) copyrule(p, add, &rs->rules[rs->numrules - 1]);
+    rs->body = p->numins;
+
+    p->ins[0] = (Ins){OP_JMP, .a = p->numins};
+    if (!rs->numrules) p->ins[p->numins++] = (Ins){OP_BRACKET, .a = 0};
+    for (int k = 0; k < rs->numrules; k++) {
+        int start = rs->rules[k].start;
+        if (k == rs->numrules - 1)
+            p->ins[p->numins] = (Ins){OP_JMP, .a = start};
+        else
+            p->ins[p->numins] = (Ins){OP_SPLIT, .a = start, .b = p->numins + 1};
+        p->numins++;
+    }
+    indextokens(p);
+    findloops(p);
+    return p;
+}
+
+// called with the lock held, returns the replaced version
+static Prog *publish(RuleSet *rs, Prog *p) {
+    Prog *old = rs->prog;
+    __atomic_store_n(&rs->prog, p, __ATOMIC_RELEASE);
+    return old;
+}
+
+void rulesetinit(RuleSet *rs, int flags) {
+    memset(rs, 0, sizeof(RuleSet));
+    rs->flags = flags;
+    regexdefaultlimits(&rs->limits);
+    pthread_mutex_init(&rs->lock, 0);
+    rs->prog = relink(rs, 0, 0, 0);
+}
+
+// applies to definitions added from now on and the program as a whole,
+// matchers switch to the new step and time limits at their next match
+void rulesetlimits(RuleSet *rs, RegExLimits *lim) {
+    pthread_mutex_lock(&rs->lock);
+    rs->limits = *lim;
+    __atomic_store_n(&rs->limitsver, rs->limitsver + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rs->lock);
+}
+
+// compiles only the new definition and patches it in
+// as the lowest priority alternative
+int rulesetadd(RuleSet *rs, TokDef *def) {
+    RegEx parser;
+    initregex(&parser);
+    pthread_mutex_lock(&rs->lock);
+    RegExLimits lim = rs->limits;
+    pthread_mutex_unlock(&rs->lock);
+    Prog *add = compile(&parser, def->pattern, rs->flags, &lim, &def->token);
+    pthread_mutex_lock(&rs->lock);
+    Prog *old = 0;
+    if (add) {
+        rs->rules = grow(rs->rules, &rs->rulescap,
+                rs->numrules + 1, sizeof(Rule));
+        rs->rules[rs->numrules++] = (Rule){
+            .token = def->token,
+            .numins = add->numins,
+            .numclasses = add->numclasses,
+            .numranges = add->numranges,
+        };
+        Prog size;
+        plan(rs, add, &size);
+        if (checkprog(&parser, &size, &rs->limits)) rs->numrules--;
+        else old = publish(rs, relink(rs, add, 0, 0));
+    }
+    rs->err = parser.err;
+    memcpy(rs->errmsg, parser.errmsg, sizeof(rs->errmsg));
+    pthread_mutex_unlock(&rs->lock);
+    if (old) releaseprog(old);
+    if (add) releaseprog(add);
+    return parser.err;
+}
+
+const char *ruleseterror(RuleSet *rs) {
+    return rs->errmsg;
+}
+
+// removes every rule defined with token, returns how many there were
+int rulesetremove(RuleSet *rs, int token) {
+    pthread_mutex_lock(&rs->lock);
+    Rule *drop = malloc((rs->numrules + 1) * sizeof(Rule));
+    int numdrop = 0;
+    int n = 0;
+    for (int k = 0; k < rs->numrules; k++) {
+        if (rs->rules[k].token == token) drop[numdrop++] = rs->rules[k];
+        else rs->rules[n++] = rs->rules[k];
+    }
+    Prog *old = 0;
+    if (numdrop) {
+        rs->numrules = n;
+        for (int k = 0; k < numdrop; k++) rs->dead += drop[k].numins;
+        old = publish(rs, relink(rs, 0, drop, numdrop));
+    }
+    pthread_mutex_unlock(&rs->lock);
+    if (old) releaseprog(old);
+    free(drop);
+    return numdrop;
+}
+
+// sets up re to match with whatever version of rs is current
+void rulesetmatcher(RuleSet *rs, RegEx *re) {
+    initregex(re);
+    re->rules = rs;
+    pthread_mutex_lock(&rs->lock);
+    re->limits = rs->limits;
+    re->limitsver = rs->limitsver;
+    Prog *p = retainprog(rs->prog);
+    pthread_mutex_unlock(&rs->lock);
+    setprog(re, p);
+}
+
+// matchers following rs must be freed first
+void freeruleset(RuleSet *rs) {
+    if (rs->prog) releaseprog(rs->prog);
+    if (rs->rules) free(rs->rules);
+    pthread_mutex_destroy(&rs->lock);
+    memset(rs, 0, sizeof(RuleSet));
+}
+
+// process wide cache of compiled programs keyed by pattern, flags and
+// the limits that apply at compile time, entries are chained per hash
+// bucket and kept in a list from most to least recently used, a program
+// stays alive after eviction as long as matchers still hold references
+typedef struct Cached Cached;
+struct Cached {
+    Prog *prog;
+    int flags;
+    RegExLimits lim; // only maxins, maxdepth and maxmem are part of the key
+    unsigned hash;
+    Cached *chain;
+    Cached *newer, *older;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    Cached **buckets;
+    int numbuckets;
+    Cached recent; // .older is the most, .newer the least recently used
+    int size;
+    int maxsize;
+    long hits;
+    long misses;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .recent = {.newer = &cache.recent, .older = &cache.recent},
+    .maxsize = 256,
+};
+
+static unsigned hashpattern(char *src, int flags, RegExLimits *lim) {
+    unsigned h = 2166136261u; // FNV-1a
+    unsigned long key[] = {flags, lim->maxins, lim->maxdepth, lim->maxmem};
+    for (int k = 0; k < sizeof(key) / sizeof(key[0]); k++)
+        h = (h ^ key[k]) * 16777619u;
+    for (; *src; src++) h = (h ^ (unsigned char)*src) * 16777619u;
+    return h;
+}
+
+static Cached **cacheslot(char *src, int flags, RegExLimits *lim,
+        unsigned hash) {
+    if (!cache.numbuckets) return 0;
+    Cached **e = &cache.buckets[hash & (cache.numbuckets - 1)];
+    for (; *e; e = &(*e)->chain) {
+        if ((*e)->hash == hash && (*e)->flags == flags
+                && (*e)->lim.maxins == lim->maxins
+                && (*e)->lim.maxdepth == lim->maxdepth
+                && (*e)->lim.maxmem == lim->maxmem
+                && strcmp((*e)->prog->src, src) == 0)
+            break;
+    }
+    return e;
+}
+
+static void unlinkrecent(Cached *e) {
+    e->newer->older = e->older;
+    e->older->newer = e->newer;
+}
+
+static void pushrecent(Cached *e) {
+    e->newer = &cache.recent;
+    e->older = cache.recent.older;
+    e->older->newer = e;
+    cache.recent.older = e;
+}
+
+// doubles the bucket count once there are more entries than buckets
+static void growcache() {
+    if (cache.size < cache.numbuckets) return;
+    int num = cache.numbuckets ? cache.numbuckets * 2 : 64;
+    Cached **buckets = calloc(num, sizeof(Cached *));
+    for (int k = 0; k < cache.numbuckets; k++) {
+        for (Cached *e = cache.buckets[k], *next; e; e = next) {
+            next = e->chain;
+            Cached **b = &buckets[e->hash & (num - 1)];
+            e->chain = *b;
+            *b = e;
+        }
+    }
+    if (cache.buckets) free(cache.buckets);
+    cache.buckets = buckets;
+    cache.numbuckets = num;
+}
+
+// drops least recently used entries until at most max are left
+static void trimcache(int max) {
+    while (cache.size > max) {
+        Cached *e = cache.recent.newer;
+        *cacheslot(e->prog->src, e->flags, &e->lim, e->hash) = e->chain;
+        unlinkrecent(e);
+        releaseprog(e->prog);
+        free(e);
+        cache.size--;
+    }
+}
+
+// like regexcompilelimits but shares the program with every other
+// matcher compiled from the same pattern, flags and compile time limits,
+// step and time limits are the matcher's own, failures are not cached
+int regexcompilecached(RegEx *re, char *src, int flags, RegExLimits *lim) {
+    RegExLimits deflim;
+    if (!lim) regexdefaultlimits(lim = &deflim);
+    initregex(re);
+    unsigned hash = hashpattern(src, flags, lim);
+    pthread_mutex_lock(&cache.lock);
+    Cached **slot = cacheslot(src, flags, lim, hash);
+    Cached *e = slot ? *slot : 0;
+    if (e) {
+        cache.hits++;
+        unlinkrecent(e);
+        pushrecent(e);
+        Prog *p = retainprog(e->prog);
+        pthread_mutex_unlock(&cache.lock);
+        re->flags = flags;
+        re->limits = *lim;
+        setprog(re, p);
+        return 0;
+    }
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+
+    Prog *p = compile(re, src, flags, lim, 0);
+    if (!p) return re->err;
+    pthread_mutex_lock(&cache.lock);
+    // another thread may have compiled it in the meantime
+    slot = cacheslot(src, flags, lim, hash);
+    if (slot && *slot) {
+        releaseprog(p);
+        p = retainprog((*slot)->prog);
+    }
+    else if (cache.maxsize) {
+        growcache();
+        e = malloc(sizeof(Cached));
+        *e = (Cached){retainprog(p), flags, *lim, hash};
+        Cached **b = &cache.buckets[hash & (cache.numbuckets - 1)];
+        e->chain = *b;
+        *b = e;
+        pushrecent(e);
+        cache.size++;
+        trimcache(cache.maxsize);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    setprog(re, p);
+    return 0;
+}
+
+// max is the number of programs kept, 0 turns caching off
+void regexcachesize(int max) {
+    pthread_mutex_lock(&cache.lock);
+    cache.maxsize = max > 0 ? max : 0;
+    trimcache(cache.maxsize);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void regexcachestats(RegExCacheStats *st) {
+    pthread_mutex_lock(&cache.lock);
+    *st = (RegExCacheStats){
+        .hits = cache.hits,
+        .misses = cache.misses,
+        .size = cache.size,
+        .maxsize = cache.maxsize,
+    };
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// empties the cache and resets its counters, matchers compiled from it
+// keep working
+void regexcacheclear() {
+    pthread_mutex_lock(&cache.lock);
+    trimcache(0);
+    if (cache.buckets) free(cache.buckets);
+    cache.buckets = 0;
+    cache.numbuckets = 0;
+    cache.hits = 0;
+    cache.misses = 0;
+    pthread_mutex_unlock(&cache.lock);
+}